@@ -54,6 +54,9 @@
 #include <libfreenect.hpp>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <iostream>
 #include <vector>
 #include <cmath>
@@ -61,6 +64,10 @@
 #include <unistd.h>
 #include "glWindowPos.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 
 #if defined(__APPLE__)
 #include <GLUT/glut.h>
@@ -86,12 +93,47 @@ using namespace std;
 bool medianFilterSet = true;
 bool inPaintSet = true;
 bool gradientMotionSet = true;
+bool packedDepthSet = false;        // ask libfreenect for FREENECT_DEPTH_11BIT_PACKED
 unsigned int bufferWidth = 320;
 unsigned int bufferHeight = 240;
 #define maxBuffers 45
 unsigned int currentBuffers = 45;
+bool decayTrailSet = false;         // single decaying buffer instead of bufferPt
+float trailLength = 8;              // decay trail time constant, in frames
 float brightnessFactor = 1;
 
+// synthetic depth source options (see SyntheticDepthSource)
+bool syntheticSet = false;
+float syntheticRate = 30;           // frames per second, 0 = as fast as possible
+int syntheticBlobs = 6;
+float syntheticBlobSize = 40;       // blob radius in 640x480 pixels
+float syntheticHoleFraction = 0.02; // fraction of pixels dropped to 2047
+float syntheticShadowFraction = 0.3;// shadow band width relative to blob width
+int syntheticNoise = 4;             // +/- raw depth units
+
+// RGB camera options (see VideoConverter)
+bool videoSet = false;
+int videoBlend = 128;               // 0..256, share of camera color in the output
+
+// contour (isoline) rendering
+#define contourOff 0
+#define contourOverlay 1
+#define contourOnly 2
+int contourMode = contourOff;
+
+// floor occupancy heatmap (see FloorHeatmap)
+bool heatmapSet = false;
+bool heatmapExportSet = false;      // only with --heatmap FILE
+bool heatmapOverlaySet = false;
+const char* heatmapPath = "danznect_heatmap.csv";
+float heatmapExportSeconds = 10;
+
+// per-dancer blobs (see BlobTracker)
+#define blobOff 0
+#define blobColors 1
+#define blobReadouts 2
+int blobMode = blobOff;
+
 // global output string
 char outputCharBuf[1024] = {0};
 char* outputString = 
@@ -123,6 +165,10 @@ bool fullscreen = false;
 int windowWidth = 640;
 int windowHeight = 480;
 int windowPad = 0;
+// output geometry, applied through the remap table (see buildRemap)
+float keystone = 0;         // >0 narrows the top edge, <0 the bottom
+bool mirrorSet = false;     // flip left-right, e.g. rear projection
+bool flipSet = false;       // flip upside down, e.g. ceiling-mounted Kinect
 
 //void *font = GLUT_BITMAP_TIMES_ROMAN_24;
 void* font = GLUT_BITMAP_HELVETICA_18;
@@ -144,6 +190,31 @@ class Mutex {
         pthread_mutex_t m_mutex;
 };
 
+// wakes a worker thread; posts while the worker is busy collapse into one
+class Event {
+    public:
+        Event() : m_set(false) {
+            pthread_mutex_init( &m_mutex, NULL );
+            pthread_cond_init( &m_cond, NULL );
+        }
+        void post() {
+            pthread_mutex_lock( &m_mutex );
+            m_set = true;
+            pthread_cond_signal( &m_cond );
+            pthread_mutex_unlock( &m_mutex );
+        }
+        void wait() {
+            pthread_mutex_lock( &m_mutex );
+            while(!m_set){ pthread_cond_wait( &m_cond, &m_mutex ); }
+            m_set = false;
+            pthread_mutex_unlock( &m_mutex );
+        }
+    private:
+        pthread_mutex_t m_mutex;
+        pthread_cond_t m_cond;
+        bool m_set;
+};
+
 // Optimized median search on 9 values
 #define PIX_SORT(a,b) { if ((a)>(b)) PIX_SWAP((a),(b)); }
 #define PIX_SWAP(a,b) { uint16_t temp=(a);(a)=(b);(b)=temp; }
@@ -343,7 +414,946 @@ void makeGradient(uint8_t gradient[], int numColors, int rArray[], int gArray[],
 }
 
 
-class MyFreenectDevice : public Freenect::FreenectDevice {
+// wall-clock time in seconds, used for frame timing
+double nowSeconds(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// FREENECT_DEPTH_11BIT_PACKED is a big-endian bit stream, 8 pixels in
+// every 11 bytes; 640 pixels make 880 bytes per row.
+#define packedRowBytes (640*11/8)
+
+// pack 11-bit depth the way the Kinect sends it (for the synthetic source)
+void packDepth11(const uint16_t* depth, uint8_t* packed, unsigned int n){
+    uint32_t buffer = 0;
+    int bitsIn = 0;
+    for(unsigned int i=0; i<n; i++){
+        buffer = (buffer << 11) | (depth[i] & 0x7ff);
+        bitsIn += 11;
+        while(bitsIn >= 8){
+            bitsIn -= 8;
+            *(packed++) = (uint8_t)(buffer >> bitsIn);
+        }
+    }
+}
+
+// Scalar reference for downsamplePacked11: unpack two rows the way
+// libfreenect does, then take the min of each 2x2 block.
+void downsamplePacked11Scalar(const uint8_t* packed, uint16_t* out){
+    uint16_t rows[2][640];
+    for(unsigned int y=0; y<240; y++){
+        for(int r=0; r<2; r++){
+            const uint8_t* raw = packed + (2*y+r)*packedRowBytes;
+            uint32_t buffer = 0;
+            int bitsIn = 0;
+            for(unsigned int x=0; x<640; x++){
+                while(bitsIn < 11){
+                    buffer = (buffer << 8) | *(raw++);
+                    bitsIn += 8;
+                }
+                bitsIn -= 11;
+                rows[r][x] = (buffer >> bitsIn) & 0x7ff;
+            }
+        }
+        for(unsigned int x=0; x<320; x++){
+            out[y*320+x] = MIN(MIN(rows[0][2*x], rows[0][2*x+1]), MIN(rows[1][2*x], rows[1][2*x+1]));
+        }
+    }
+}
+
+#if defined(__SSE2__)
+// 8 pixels from one 11-byte group, as 8 lanes
+static inline __m128i unpack11x8(const uint8_t* p){
+    uint64_t hi;
+    memcpy(&hi, p, 8);
+    hi = __builtin_bswap64(hi);
+    uint32_t lo = (p[8] << 16) | (p[9] << 8) | p[10];
+    return _mm_set_epi16((short)(lo & 0x7ff),
+                         (short)((lo >> 11) & 0x7ff),
+                         (short)(((hi & 0x1ff) << 2) | (lo >> 22)),
+                         (short)((hi >> 9) & 0x7ff),
+                         (short)((hi >> 20) & 0x7ff),
+                         (short)((hi >> 31) & 0x7ff),
+                         (short)((hi >> 42) & 0x7ff),
+                         (short)(hi >> 53));
+}
+#endif
+
+// 2x2 min downsample straight from the packed stream, so the 640x480
+// 16-bit frame never exists. 16 input columns (two groups) per step.
+void downsamplePacked11(const uint8_t* packed, uint16_t* out){
+#if defined(__SSE2__)
+    const __m128i lowWord = _mm_set1_epi32(0xffff);
+    for(unsigned int y=0; y<240; y++){
+        const uint8_t* row0 = packed + (2*y)*packedRowBytes;
+        const uint8_t* row1 = row0 + packedRowBytes;
+        for(unsigned int x=0; x<320; x+=8){
+            unsigned int g = (2*x/8)*11;
+            __m128i a = _mm_min_epi16(unpack11x8(row0+g), unpack11x8(row1+g));
+            __m128i b = _mm_min_epi16(unpack11x8(row0+g+11), unpack11x8(row1+g+11));
+            // min of horizontal neighbours lands in the low word of each pair
+            a = _mm_and_si128(_mm_min_epi16(a, _mm_srli_epi32(a, 16)), lowWord);
+            b = _mm_and_si128(_mm_min_epi16(b, _mm_srli_epi32(b, 16)), lowWord);
+            _mm_storeu_si128((__m128i*)(out + y*320 + x), _mm_packs_epi32(a, b));
+        }
+    }
+#else
+    downsamplePacked11Scalar(packed, out);
+#endif
+}
+
+// --selftest: pack a random frame and check downsamplePacked11 against
+// the scalar reference and against the plain 16-bit downsample
+bool selfTestPacked(){
+    vector<uint16_t> depth(640*480);
+    vector<uint8_t> packed(packedRowBytes*480);
+    vector<uint16_t> fast(320*240), reference(320*240);
+    uint32_t seed = 0x2545F491;
+    for(unsigned int i=0; i<depth.size(); i++){
+        seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+        // include holes, they are the largest value the stream carries
+        depth[i] = seed % 16 == 0 ? 2047 : seed & 0x7ff;
+    }
+    packDepth11(&depth[0], &packed[0], depth.size());
+    downsamplePacked11(&packed[0], &fast[0]);
+    downsamplePacked11Scalar(&packed[0], &reference[0]);
+
+    unsigned int mismatches = 0;
+    for(unsigned int y=0; y<240; y++){
+        for(unsigned int x=0; x<320; x++){
+            uint16_t plain = MIN(MIN(depth[y*2*640+x*2], depth[y*2*640+x*2+1]),
+                                 MIN(depth[(y*2+1)*640+x*2], depth[(y*2+1)*640+x*2+1]));
+            if(fast[y*320+x] != reference[y*320+x] || reference[y*320+x] != plain){ mismatches++; }
+        }
+    }
+    printf("packed 11-bit downsample: %u mismatches of %u pixels\n", mismatches, 320*240);
+    return mismatches == 0;
+}
+
+// Kinect Bayer frames are GRBG, so each 2x2 block holds exactly one red,
+// two green and one blue sample - demosaic and downsample to 320x240 in
+// one step. Output is 4 bytes per pixel (RGBX).
+void bayerToRgbxHalf(const uint8_t* raw, uint8_t* out){
+    for(unsigned int y=0; y<240; y++){
+        const uint8_t* row0 = raw + (2*y)*640;     // G R G R ...
+        const uint8_t* row1 = row0 + 640;          // B G B G ...
+        uint8_t* dst = out + 4*y*320;
+        unsigned int x = 0;
+#if defined(__SSE2__)
+        const __m128i lowByte = _mm_set1_epi16(0x00ff);
+        for(; x+8<=320; x+=8){
+            __m128i a = _mm_loadu_si128((const __m128i*)(row0+2*x));
+            __m128i b = _mm_loadu_si128((const __m128i*)(row1+2*x));
+            __m128i r = _mm_srli_epi16(a, 8);
+            __m128i g = _mm_avg_epu16(_mm_and_si128(a, lowByte), _mm_srli_epi16(b, 8));
+            __m128i blue = _mm_and_si128(b, lowByte);
+            __m128i rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+            _mm_storeu_si128((__m128i*)(dst+4*x),   _mm_unpacklo_epi16(rg, blue));
+            _mm_storeu_si128((__m128i*)(dst+4*x+16), _mm_unpackhi_epi16(rg, blue));
+        }
+#endif
+        for(; x<320; x++){
+            dst[4*x+0] = row0[2*x+1];
+            dst[4*x+1] = (uint8_t)((row0[2*x] + row1[2*x+1] + 1) >> 1);
+            dst[4*x+2] = row1[2*x];
+            dst[4*x+3] = 0;
+        }
+    }
+}
+
+// 2x2 box downsample of a 640x480 RGB frame to 320x240 RGBX
+void rgbToRgbxHalf(const uint8_t* rgb, uint8_t* out){
+    uint8_t rowAvg[640*3+16];
+    for(unsigned int y=0; y<240; y++){
+        const uint8_t* row0 = rgb + (2*y)*640*3;
+        const uint8_t* row1 = row0 + 640*3;
+        uint8_t* dst = out + 4*y*320;
+        unsigned int i = 0;
+#if defined(__SSE2__)
+        // vertical average, 16 bytes at a time
+        for(; i+16<=640*3; i+=16){
+            __m128i a = _mm_loadu_si128((const __m128i*)(row0+i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(row1+i));
+            _mm_storeu_si128((__m128i*)(rowAvg+i), _mm_avg_epu8(a, b));
+        }
+        // horizontal average against the pixel 3 bytes over; the results
+        // we keep land on bytes 6x..6x+2
+        for(i=0; i+16<=640*3; i+=16){
+            __m128i a = _mm_loadu_si128((const __m128i*)(rowAvg+i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(rowAvg+i+3));
+            _mm_storeu_si128((__m128i*)(rowAvg+i), _mm_avg_epu8(a, b));
+        }
+        for(unsigned int x=0; x<320; x++){
+            dst[4*x+0] = rowAvg[6*x+0];
+            dst[4*x+1] = rowAvg[6*x+1];
+            dst[4*x+2] = rowAvg[6*x+2];
+            dst[4*x+3] = 0;
+        }
+#else
+        for(unsigned int x=0; x<320; x++){
+            for(unsigned int c=0; c<3; c++){
+                dst[4*x+c] = (uint8_t)((row0[6*x+c] + row0[6*x+3+c] + row1[6*x+c] + row1[6*x+3+c] + 2) >> 2);
+            }
+            dst[4*x+3] = 0;
+        }
+#endif
+    }
+}
+
+// Converts camera frames to 320x240 RGBX on its own thread and keeps the
+// last few, so the depth pass can pick the one closest in time.
+#define videoSlots 4
+class VideoConverter {
+    public:
+        VideoConverter(freenect_video_format format) :
+        m_format(format),
+        m_raw_back(640*480*3),
+        m_raw_pending(640*480*3),
+        m_raw_work(640*480*3),
+        m_raw_fresh(false),
+        m_reading(-1) {
+            for(int i=0; i<videoSlots; i++){
+                m_frames[i].resize(320*240*4);
+                m_timestamps[i] = 0;
+                m_valid[i] = false;
+            }
+        }
+
+        void start() {
+            pthread_create(&m_thread, NULL, &VideoConverter::threadMain, this);
+        }
+
+        // called from the libfreenect thread; keep it to a copy. Only this
+        // thread touches m_raw_back, so the lock just covers the swap.
+        void pushRaw(void* data, uint32_t timestamp) {
+            memcpy(&m_raw_back[0], data, m_format == FREENECT_VIDEO_BAYER ? 640*480 : 640*480*3);
+            m_raw_mutex.lock();
+            m_raw_back.swap(m_raw_pending);
+            m_raw_timestamp = timestamp;
+            m_raw_fresh = true;
+            m_raw_mutex.unlock();
+            m_event.post();
+        }
+
+        // converted frame nearest to timestamp, or NULL; hold it until release()
+        const uint8_t* acquireNearest(uint32_t timestamp) {
+            m_slot_mutex.lock();
+            int best = -1;
+            uint32_t bestSkew = 0;
+            for(int i=0; i<videoSlots; i++){
+                if(!m_valid[i]){ continue; }
+                int32_t diff = (int32_t)(m_timestamps[i]-timestamp);
+                uint32_t skew = diff < 0 ? -diff : diff;
+                if(best < 0 || skew < bestSkew){ best = i; bestSkew = skew; }
+            }
+            m_reading = best;
+            m_slot_mutex.unlock();
+            return best < 0 ? NULL : &m_frames[best][0];
+        }
+
+        void release() {
+            m_slot_mutex.lock();
+            m_reading = -1;
+            m_slot_mutex.unlock();
+        }
+
+    private:
+        static void* threadMain(void* arg) {
+            static_cast<VideoConverter*>(arg)->run();
+            return NULL;
+        }
+
+        void run() {
+            while(true){
+                m_event.wait();
+
+                // take the newest raw frame; convert it without the lock
+                m_raw_mutex.lock();
+                if(!m_raw_fresh){
+                    m_raw_mutex.unlock();
+                    continue;
+                }
+                m_raw_work.swap(m_raw_pending);
+                uint32_t timestamp = m_raw_timestamp;
+                m_raw_fresh = false;
+                m_raw_mutex.unlock();
+
+                // overwrite the oldest slot nobody is reading
+                m_slot_mutex.lock();
+                int slot = -1;
+                for(int i=0; i<videoSlots; i++){
+                    if(i == m_reading){ continue; }
+                    if(slot < 0 || !m_valid[i] || (int32_t)(m_timestamps[i]-m_timestamps[slot]) < 0){ slot = i; }
+                    if(!m_valid[i]){ break; }
+                }
+                m_valid[slot] = false;
+                m_slot_mutex.unlock();
+
+                if(m_format == FREENECT_VIDEO_BAYER){
+                    bayerToRgbxHalf(&m_raw_work[0], &m_frames[slot][0]);
+                }else{
+                    rgbToRgbxHalf(&m_raw_work[0], &m_frames[slot][0]);
+                }
+
+                m_slot_mutex.lock();
+                m_timestamps[slot] = timestamp;
+                m_valid[slot] = true;
+                m_slot_mutex.unlock();
+            }
+        }
+
+        freenect_video_format m_format;
+        vector<uint8_t> m_raw_back;     // being filled by pushRaw
+        vector<uint8_t> m_raw_pending;  // newest complete frame
+        vector<uint8_t> m_raw_work;     // being converted
+        uint32_t m_raw_timestamp;
+        bool m_raw_fresh;
+        Mutex m_raw_mutex;
+        Event m_event;
+        vector<uint8_t> m_frames[videoSlots];
+        uint32_t m_timestamps[videoSlots];
+        bool m_valid[videoSlots];
+        int m_reading;
+        Mutex m_slot_mutex;
+        pthread_t m_thread;
+};
+
+VideoConverter* videoConverter = NULL;
+
+// Background model for the occupancy tests: a running max of the valid
+// depth (the farthest thing seen), lowered by decay so that furniture
+// moved into the scene eventually becomes background.
+void updateBackground(const uint16_t* depth, uint16_t* background, unsigned int n, uint16_t decay){
+    unsigned int i = 0;
+#if defined(__SSE2__)
+    const __m128i hole = _mm_set1_epi16(2047);
+    const __m128i step = _mm_set1_epi16((short)decay);
+    for(; i+8<=n; i+=8){
+        __m128i d = _mm_loadu_si128((const __m128i*)(depth+i));
+        d = _mm_andnot_si128(_mm_cmpeq_epi16(d, hole), d);
+        __m128i bg = _mm_subs_epu16(_mm_loadu_si128((const __m128i*)(background+i)), step);
+        _mm_storeu_si128((__m128i*)(background+i), _mm_max_epi16(bg, d));
+    }
+#endif
+    for(; i<n; i++){
+        uint16_t d = depth[i] == 2047 ? 0 : depth[i];
+        uint16_t bg = background[i] > decay ? background[i]-decay : 0;
+        background[i] = MAX(bg, d);
+    }
+}
+
+// nearer than the background by more than this counts as foreground
+#define backgroundThreshold 40
+// the background drops one depth unit every this many frames (about one
+// unit per second at 30 fps)
+#define backgroundDecayFrames 30
+
+// One background model per consumer. The heatmap reads its model on its
+// own thread and only sees the frames it accepts, while the blob tracker
+// needs one that is current for every rendered frame; sharing would mean
+// locking the render path against the heatmap worker.
+class BackgroundModel {
+    public:
+        vector<uint16_t> depth;
+
+        BackgroundModel() :
+        depth(bufferWidth*bufferHeight, 0),
+        m_frames(0) {
+        }
+
+        void update(const uint16_t* frame) {
+            updateBackground(frame, &depth[0], depth.size(), m_frames % backgroundDecayFrames == 0 ? 1 : 0);
+            m_frames++;
+        }
+
+    private:
+        unsigned int m_frames;
+};
+
+// Accumulates, per heatCell x heatCell block of the depth map, how often
+// it was occupied (nearer than the background) and how often it changed
+// from one frame to the next. Runs on its own thread: the depth pass hands
+// over its procDepth buffer and gets a retired one back, so frames are
+// never copied. Frames arriving while the worker is busy are skipped.
+#define heatCell 16
+#define maxHeatCols (640/heatCell)
+class FloorHeatmap {
+    public:
+        unsigned int cols, rows;
+
+        FloorHeatmap() :
+        cols(bufferWidth/heatCell),
+        rows(bufferHeight/heatCell),
+        m_occupancy(cols*rows, 0),
+        m_activity(cols*rows, 0),
+        m_frames(0),
+        m_incoming(NULL),
+        m_has_previous(false),
+        m_busy(false),
+        m_activity_threshold(15) {
+            m_previous = (uint16_t*) malloc(bufferWidth*bufferHeight*sizeof(uint16_t));
+            m_spare = (uint16_t*) malloc(bufferWidth*bufferHeight*sizeof(uint16_t));
+            m_next_export = nowSeconds() + heatmapExportSeconds;
+        }
+
+        void start() {
+            pthread_create(&m_thread, NULL, &FloorHeatmap::threadMain, this);
+        }
+
+        // hand frame to the worker; returns the buffer to render the next
+        // frame into (frame itself if the worker is still busy)
+        uint16_t* offer(uint16_t* frame) {
+            m_handoff_mutex.lock();
+            if(m_busy){
+                m_handoff_mutex.unlock();
+                return frame;
+            }
+            uint16_t* next = m_spare;
+            m_spare = NULL;
+            m_incoming = frame;
+            m_busy = true;
+            m_handoff_mutex.unlock();
+            m_event.post();
+            return next;
+        }
+
+        // fraction of frames each cell was occupied / active
+        unsigned int snapshot(vector<float> &occupancy, vector<float> &activity) {
+            m_stats_mutex.lock();
+            occupancy.resize(cols*rows);
+            activity.resize(cols*rows);
+            for(unsigned int c=0; c<cols*rows; c++){
+                occupancy[c] = m_frames ? float(m_occupancy[c])/(m_frames*heatCell*heatCell) : 0;
+                activity[c] = m_frames ? float(m_activity[c])/(m_frames*heatCell*heatCell) : 0;
+            }
+            unsigned int frames = m_frames;
+            m_stats_mutex.unlock();
+            return frames;
+        }
+
+        // also called on quit, so exports are serialised
+        void exportSnapshot() {
+            m_export_mutex.lock();
+            writeSnapshot();
+            m_export_mutex.unlock();
+        }
+
+    private:
+        static void* threadMain(void* arg) {
+            static_cast<FloorHeatmap*>(arg)->run();
+            return NULL;
+        }
+
+        void run() {
+            while(true){
+                m_event.wait();
+                accumulate(m_incoming);
+
+                // the old previous frame becomes the next spare
+                m_handoff_mutex.lock();
+                m_spare = m_previous;
+                m_previous = m_incoming;
+                m_incoming = NULL;
+                m_has_previous = true;
+                m_busy = false;
+                m_handoff_mutex.unlock();
+
+                if(heatmapExportSet && nowSeconds() >= m_next_export){
+                    exportSnapshot();
+                    m_next_export = nowSeconds() + heatmapExportSeconds;
+                }
+            }
+        }
+
+        void accumulate(const uint16_t* depth) {
+            m_background.update(depth);
+
+            vector<uint32_t> occupied(cols), active(cols);
+            for(unsigned int cy=0; cy<rows; cy++){
+                for(unsigned int cx=0; cx<cols; cx++){
+                    occupied[cx] = 0;
+                    active[cx] = 0;
+                }
+                countCells(depth, cy, &occupied[0], &active[0]);
+                m_stats_mutex.lock();
+                for(unsigned int cx=0; cx<cols; cx++){
+                    m_occupancy[cy*cols+cx] += occupied[cx];
+                    m_activity[cy*cols+cx] += active[cx];
+                }
+                m_stats_mutex.unlock();
+            }
+            m_stats_mutex.lock();
+            m_frames++;
+            m_stats_mutex.unlock();
+        }
+
+        // occupied / changed pixel counts for each cell in one row of cells
+        void countCells(const uint16_t* depth, unsigned int cy, uint32_t* occupied, uint32_t* active) {
+            const uint16_t* previous = m_has_previous ? m_previous : depth;
+#if defined(__SSE2__)
+            const __m128i hole = _mm_set1_epi16(2047);
+            const __m128i occupiedThreshold = _mm_set1_epi16(backgroundThreshold);
+            const __m128i activityThreshold = _mm_set1_epi16((short)m_activity_threshold);
+            // 16-bit lane counters, at most 2*heatCell per lane
+            __m128i occ[maxHeatCols], act[maxHeatCols];
+            for(unsigned int cx=0; cx<cols; cx++){
+                occ[cx] = _mm_setzero_si128();
+                act[cx] = _mm_setzero_si128();
+            }
+            for(unsigned int y=cy*heatCell; y<(cy+1)*heatCell; y++){
+                for(unsigned int x=0; x<cols*heatCell; x+=8){
+                    unsigned int i = y*bufferWidth + x;
+                    __m128i d = _mm_loadu_si128((const __m128i*)(depth+i));
+                    __m128i p = _mm_loadu_si128((const __m128i*)(previous+i));
+                    __m128i bg = _mm_loadu_si128((const __m128i*)(&m_background.depth[i]));
+                    __m128i valid = _mm_andnot_si128(_mm_cmpeq_epi16(d, hole), _mm_set1_epi16(-1));
+                    __m128i near = _mm_and_si128(valid, _mm_cmplt_epi16(_mm_add_epi16(d, occupiedThreshold), bg));
+                    __m128i change = _mm_or_si128(_mm_subs_epu16(d, p), _mm_subs_epu16(p, d));
+                    __m128i moved = _mm_and_si128(valid, _mm_andnot_si128(_mm_cmpeq_epi16(p, hole),
+                                                  _mm_cmpgt_epi16(change, activityThreshold)));
+                    // masks are -1, so subtracting counts them
+                    occ[x/heatCell] = _mm_sub_epi16(occ[x/heatCell], near);
+                    act[x/heatCell] = _mm_sub_epi16(act[x/heatCell], moved);
+                }
+            }
+            for(unsigned int cx=0; cx<cols; cx++){
+                uint16_t o[8], a[8];
+                _mm_storeu_si128((__m128i*)o, occ[cx]);
+                _mm_storeu_si128((__m128i*)a, act[cx]);
+                for(int k=0; k<8; k++){
+                    occupied[cx] += o[k];
+                    active[cx] += a[k];
+                }
+            }
+#else
+            for(unsigned int y=cy*heatCell; y<(cy+1)*heatCell; y++){
+                for(unsigned int x=0; x<cols*heatCell; x++){
+                    unsigned int i = y*bufferWidth + x;
+                    uint16_t d = depth[i], p = previous[i];
+                    if(d == 2047){ continue; }
+                    if(d + backgroundThreshold < m_background.depth[i]){ occupied[x/heatCell]++; }
+                    if(p != 2047 && abs(int(d)-int(p)) > m_activity_threshold){ active[x/heatCell]++; }
+                }
+            }
+#endif
+        }
+
+        // write the heatmap as CSV, via a temporary file so readers never
+        // see a partial snapshot
+        void writeSnapshot() {
+            vector<float> occupancy, activity;
+            unsigned int frames = snapshot(occupancy, activity);
+            char tempPath[1024];
+            snprintf(tempPath, sizeof(tempPath), "%s.tmp", heatmapPath);
+            FILE* f = fopen(tempPath, "w");
+            if(!f){
+                printf("\r\n could not write heatmap to %s\n", tempPath);
+                fflush(stdout);
+                return;
+            }
+            fprintf(f, "# danznect heatmap, %u frames, %ux%u cells of %ux%u pixels\n", frames, cols, rows, heatCell, heatCell);
+            for(int table=0; table<2; table++){
+                vector<float> &values = table == 0 ? occupancy : activity;
+                fprintf(f, table == 0 ? "# occupancy\n" : "# activity\n");
+                for(unsigned int cy=0; cy<rows; cy++){
+                    for(unsigned int cx=0; cx<cols; cx++){
+                        fprintf(f, cx ? ",%.4f" : "%.4f", values[cy*cols+cx]);
+                    }
+                    fprintf(f, "\n");
+                }
+            }
+            fclose(f);
+            rename(tempPath, heatmapPath);
+        }
+
+        vector<uint32_t> m_occupancy;
+        vector<uint32_t> m_activity;
+        unsigned int m_frames;
+        Mutex m_stats_mutex;
+        BackgroundModel m_background;
+        uint16_t* m_incoming;
+        uint16_t* m_previous;
+        uint16_t* m_spare;
+        bool m_has_previous;
+        bool m_busy;
+        Mutex m_handoff_mutex;
+        Mutex m_export_mutex;
+        Event m_event;
+        int m_activity_threshold;
+        double m_next_export;
+        pthread_t m_thread;
+};
+
+FloorHeatmap* heatmap = NULL;
+
+// a connected foreground region, tracked from frame to frame
+struct Blob {
+    int id;                     // stable while the blob is tracked
+    unsigned int area;          // pixels
+    float cx, cy;               // centroid
+    float vx, vy;               // centroid velocity, pixels per second
+    uint16_t x0, y0, x1, y1;    // bounding box, inclusive
+    uint8_t color[3];
+};
+
+// horizontal run of foreground pixels, the unit of the union-find
+struct BlobRun {
+    uint16_t y, x0, x1;
+    int parent;
+};
+
+// Segments the foreground (nearer than a running-max background) and
+// labels 8-connected regions using runs rather than pixels: runs that
+// touch a run on the row above are merged with union-find, then region
+// stats are summed per run. Regions are matched to last frame's blobs by
+// nearest centroid so each dancer keeps an id and a color.
+#define maxBlobs 32
+class BlobTracker {
+    public:
+        vector<uint8_t> labels;     // per pixel: index into blobs + 1, 0 = none
+        vector<Blob> blobs;
+
+        BlobTracker() :
+        labels(bufferWidth*bufferHeight, 0),
+        m_next_id(1),
+        m_last_time(0),
+        m_min_area(150),
+        m_gate(40) {
+        }
+
+        void update(const uint16_t* depth) {
+            m_background.update(depth);
+
+            findRuns(depth);
+            linkRuns();
+            measureBlobs();
+            trackBlobs();
+
+            // paint labels run by run
+            memset(&labels[0], 0, labels.size());
+            for(unsigned int r=0; r<m_runs.size(); r++){
+                uint8_t label = m_root_label[find(r)];
+                if(label){
+                    memset(&labels[m_runs[r].y*bufferWidth + m_runs[r].x0], label, m_runs[r].x1-m_runs[r].x0+1);
+                }
+            }
+        }
+
+    private:
+        void findRuns(const uint16_t* depth) {
+            m_runs.clear();
+            m_row_start.assign(bufferHeight+1, 0);
+            // skip the border buildRemap leaves black; the last chunk's
+            // loads run into the next row, which is fine as y < bufferHeight-1
+            unsigned int xStart = 2, xEnd = bufferWidth-5;
+            for(unsigned int y=1; y<bufferHeight-1; y++){
+                m_row_start[y] = m_runs.size();
+                const uint16_t* row = depth + y*bufferWidth;
+                const uint16_t* bg = &m_background.depth[y*bufferWidth];
+                int runStart = -1;
+                for(unsigned int x=xStart; x<xEnd; x+=8){
+                    unsigned int bits = foregroundBits(row+x, bg+x);
+                    if(x+8 > xEnd){ bits &= (1 << (xEnd-x)) - 1; }
+                    // whole chunk continues the current state
+                    if(bits == 0 && runStart < 0){ continue; }
+                    if(bits == 0xff && runStart >= 0){ continue; }
+                    for(unsigned int k=0; k<8; k++){
+                        bool fg = (bits >> k) & 1;
+                        if(fg && runStart < 0){
+                            runStart = x+k;
+                        }else if(!fg && runStart >= 0){
+                            addRun(y, runStart, x+k-1);
+                            runStart = -1;
+                        }
+                    }
+                }
+                if(runStart >= 0){ addRun(y, runStart, xEnd-1); }
+            }
+            m_row_start[bufferHeight-1] = m_runs.size();
+            m_row_start[bufferHeight] = m_runs.size();
+        }
+
+        // one bit per pixel for 8 pixels: valid and nearer than background
+        unsigned int foregroundBits(const uint16_t* d, const uint16_t* bg) {
+#if defined(__SSE2__)
+            __m128i v = _mm_loadu_si128((const __m128i*)d);
+            __m128i b = _mm_loadu_si128((const __m128i*)bg);
+            __m128i fg = _mm_andnot_si128(_mm_cmpeq_epi16(v, _mm_set1_epi16(2047)),
+                                          _mm_cmplt_epi16(_mm_add_epi16(v, _mm_set1_epi16(backgroundThreshold)), b));
+            return _mm_movemask_epi8(_mm_packs_epi16(fg, _mm_setzero_si128())) & 0xff;
+#else
+            unsigned int bits = 0;
+            for(int k=0; k<8; k++){
+                if(d[k] != 2047 && d[k] + backgroundThreshold < bg[k]){ bits |= 1 << k; }
+            }
+            return bits;
+#endif
+        }
+
+        void addRun(unsigned int y, unsigned int x0, unsigned int x1) {
+            BlobRun run;
+            run.y = y; run.x0 = x0; run.x1 = x1;
+            run.parent = m_runs.size();
+            m_runs.push_back(run);
+        }
+
+        int find(int r) {
+            while(m_runs[r].parent != r){
+                m_runs[r].parent = m_runs[m_runs[r].parent].parent;
+                r = m_runs[r].parent;
+            }
+            return r;
+        }
+
+        void unite(int a, int b) {
+            a = find(a);
+            b = find(b);
+            if(a == b){ return; }
+            // lower index becomes the root, keeping roots in scan order
+            if(a < b){ m_runs[b].parent = a; }else{ m_runs[a].parent = b; }
+        }
+
+        // merge each run with the runs above it that touch it, diagonals included
+        void linkRuns() {
+            for(unsigned int y=2; y<bufferHeight-1; y++){
+                unsigned int above = m_row_start[y-1], aboveEnd = m_row_start[y];
+                for(unsigned int r=m_row_start[y]; r<m_row_start[y+1]; r++){
+                    // runs above that end left of this one can't touch later runs either
+                    while(above < aboveEnd && m_runs[above].x1+1 < m_runs[r].x0){ above++; }
+                    for(unsigned int a=above; a<aboveEnd && m_runs[a].x0 <= m_runs[r].x1+1; a++){
+                        unite(r, a);
+                    }
+                }
+            }
+        }
+
+        void measureBlobs() {
+            m_root_label.assign(m_runs.size(), 0);
+            m_found.clear();
+            m_found_root.clear();
+            vector<int> rootBlob(m_runs.size(), -1);
+            vector<double> sumX, sumY;
+            for(unsigned int r=0; r<m_runs.size(); r++){
+                int root = find(r);
+                if(rootBlob[root] < 0){
+                    rootBlob[root] = m_found.size();
+                    Blob b;
+                    b.id = 0; b.area = 0;
+                    b.vx = 0; b.vy = 0;
+                    b.x0 = m_runs[r].x0; b.x1 = m_runs[r].x1;
+                    b.y0 = b.y1 = m_runs[r].y;
+                    m_found.push_back(b);
+                    m_found_root.push_back(root);
+                    sumX.push_back(0);
+                    sumY.push_back(0);
+                }
+                int i = rootBlob[root];
+                unsigned int len = m_runs[r].x1 - m_runs[r].x0 + 1;
+                Blob &b = m_found[i];
+                b.area += len;
+                sumX[i] += 0.5*(m_runs[r].x0 + m_runs[r].x1)*len;
+                sumY[i] += double(m_runs[r].y)*len;
+                b.x0 = MIN(b.x0, m_runs[r].x0);
+                b.x1 = MAX(b.x1, m_runs[r].x1);
+                b.y1 = m_runs[r].y;
+            }
+            for(unsigned int i=0; i<m_found.size(); i++){
+                m_found[i].cx = sumX[i]/m_found[i].area;
+                m_found[i].cy = sumY[i]/m_found[i].area;
+            }
+        }
+
+        void trackBlobs() {
+            double now = nowSeconds();
+            double dt = m_last_time > 0 ? now - m_last_time : 0;
+            m_last_time = now;
+
+            // biggest regions first, dropping specks and anything past maxBlobs
+            vector<int> order;
+            for(unsigned int i=0; i<m_found.size(); i++){
+                if(m_found[i].area >= m_min_area){ order.push_back(i); }
+            }
+            for(unsigned int i=1; i<order.size(); i++){
+                for(unsigned int j=i; j>0 && m_found[order[j]].area > m_found[order[j-1]].area; j--){
+                    int t = order[j]; order[j] = order[j-1]; order[j-1] = t;
+                }
+            }
+            if(order.size() > maxBlobs){ order.resize(maxBlobs); }
+
+            vector<Blob> previous;
+            previous.swap(blobs);
+            vector<bool> matched(previous.size(), false);
+            for(unsigned int n=0; n<order.size(); n++){
+                Blob b = m_found[order[n]];
+                int best = -1;
+                float bestDist = m_gate*m_gate;
+                for(unsigned int p=0; p<previous.size(); p++){
+                    if(matched[p]){ continue; }
+                    float dx = b.cx-previous[p].cx, dy = b.cy-previous[p].cy;
+                    if(dx*dx+dy*dy < bestDist){ best = p; bestDist = dx*dx+dy*dy; }
+                }
+                if(best >= 0){
+                    Blob &p = previous[best];
+                    matched[best] = true;
+                    b.id = p.id;
+                    memcpy(b.color, p.color, 3);
+                    if(dt > 0){
+                        // smoothed, centroids jitter as limbs come and go
+                        b.vx = 0.7f*p.vx + 0.3f*(b.cx-p.cx)/dt;
+                        b.vy = 0.7f*p.vy + 0.3f*(b.cy-p.cy)/dt;
+                    }
+                }else{
+                    b.id = m_next_id++;
+                    blobColor(b.id, b.color);
+                }
+                m_root_label[m_found_root[order[n]]] = blobs.size()+1;
+                blobs.push_back(b);
+            }
+        }
+
+        // fully saturated hue, golden-ratio spaced so neighbours differ
+        static void blobColor(int id, uint8_t* color) {
+            float h = fmodf(id*0.618034f, 1.0f)*6;
+            int sector = int(h);
+            float f = h-sector;
+            uint8_t up = uint8_t(255*f), down = uint8_t(255*(1-f));
+            uint8_t table[6][3] = {{255,up,0}, {down,255,0}, {0,255,up}, {0,down,255}, {up,0,255}, {255,0,down}};
+            memcpy(color, table[sector % 6], 3);
+        }
+
+        BackgroundModel m_background;
+        vector<BlobRun> m_runs;
+        vector<unsigned int> m_row_start;
+        vector<Blob> m_found;
+        vector<int> m_found_root;
+        vector<uint8_t> m_root_label;
+        int m_next_id;
+        double m_last_time;
+        unsigned int m_min_area;
+        float m_gate;
+};
+
+// Flags the contour-line pixels among 8 depth values starting at p (0xff in
+// mask for a line pixel, 0 otherwise): a pixel
+// is on a line where its quantised depth (depth+offset)/interval differs
+// from its right or lower neighbour. Depths outside [lo,hi] get no lines.
+void contourEdges(const uint16_t* p, unsigned int stride, int offset, int interval, int lo, int hi, uint8_t* mask){
+#if defined(__SSE2__)
+    // floor((d+offset+0.5)/interval) is exact in float for 11-bit depths
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i off = _mm_set1_epi16((short)offset);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 scale = _mm_set1_ps(1.0f/interval);
+    __m128i band[3];
+    const uint16_t* src[3] = {p, p+1, p+stride};
+    for(int k=0; k<3; k++){
+        __m128i d = _mm_add_epi16(_mm_loadu_si128((const __m128i*)src[k]), off);
+        __m128 a = _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(d, zero)), half), scale);
+        __m128 b = _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(d, zero)), half), scale);
+        band[k] = _mm_packs_epi32(_mm_cvttps_epi32(a), _mm_cvttps_epi32(b));
+    }
+    __m128i same = _mm_and_si128(_mm_cmpeq_epi16(band[0], band[1]), _mm_cmpeq_epi16(band[0], band[2]));
+    __m128i d = _mm_loadu_si128((const __m128i*)p);
+    __m128i inRange = _mm_and_si128(_mm_cmpgt_epi16(d, _mm_set1_epi16((short)(lo-1))),
+                                    _mm_cmplt_epi16(d, _mm_set1_epi16((short)(hi+1))));
+    __m128i line = _mm_andnot_si128(same, inRange);
+    _mm_storel_epi64((__m128i*)mask, _mm_packs_epi16(line, line));
+#else
+    for(int k=0; k<8; k++){
+        int band = (p[k]+offset)/interval;
+        bool edge = band != (p[k+1]+offset)/interval || band != (p[k+stride]+offset)/interval;
+        mask[k] = (edge && p[k] >= lo && p[k] <= hi) ? 0xff : 0;
+    }
+#endif
+}
+
+// Width of the picture at height v (0 = top, 1 = bottom) as a fraction of
+// the window, after padding and keystone.
+float remapWidth(float v){
+    float width = 1 - 2*windowPad/640.0f;
+    if(keystone > 0){ width *= 1 - keystone*(1-v); }
+    if(keystone < 0){ width *= 1 + keystone*v; }
+    // never collapse (or turn inside out) however wide the padding
+    return MAX(width, 1/64.0f);
+}
+
+// Fills lut with, for every output pixel, the procDepth index it shows, or
+// -1 for black. Padding, keystone, mirror and flip all end up in this one
+// table, so colorizing through it costs the same whatever the geometry.
+void buildRemap(int* lut, unsigned int width, unsigned int height){
+    for(unsigned int oy=0; oy<height; oy++){
+        float v = (oy+0.5f)/height;
+        float scale = remapWidth(v);
+        for(unsigned int ox=0; ox<width; ox++){
+            float u = ((ox+0.5f)/width - 0.5f)/scale + 0.5f;
+            float sv = flipSet ? 1-v : v;
+            if(mirrorSet){ u = 1-u; }
+            int sx = int(floorf(u*width)), sy = int(floorf(sv*height));
+            // the border is left black, as inpainting and the median don't reach it
+            if(sx < 2 || sx >= int(width)-5 || sy < 1 || sy >= int(height)-1){
+                lut[oy*width+ox] = -1;
+            }else{
+                lut[oy*width+ox] = sy*width+sx;
+            }
+        }
+    }
+}
+
+// Where a point of the depth map ends up on screen (in the 640x480 ortho
+// space), so overlays can follow the remap.
+void sourceToScreen(float sx, float sy, float &x, float &y){
+    float u = sx/bufferWidth, v = sy/bufferHeight;
+    if(mirrorSet){ u = 1-u; }
+    if(flipSet){ v = 1-v; }
+    x = ((u-0.5f)*remapWidth(v) + 0.5f)*640;
+    y = v*480;
+}
+
+// Constant-memory motion trail. trail holds depth in 11.5 fixed point; a
+// closer new depth replaces it, a farther one pulls it back by rate/65536
+// of the difference. The result goes to out as plain 11-bit depth.
+void decayTrail(const uint16_t* depth, uint16_t* trail, uint16_t* out, unsigned int n, uint16_t rate){
+    unsigned int i = 0;
+#if defined(__SSE2__)
+    const __m128i r = _mm_set1_epi16((short)rate);
+    for(; i+8<=n; i+=8){
+        __m128i d = _mm_slli_epi16(_mm_loadu_si128((const __m128i*)(depth+i)), 5);
+        __m128i t = _mm_loadu_si128((const __m128i*)(trail+i));
+        // relax toward d; zero step when d is closer, otherwise at least
+        // one unit so long trails still reach the real depth
+        __m128i diff = _mm_subs_epu16(d, t);
+        __m128i atLeastOne = _mm_andnot_si128(_mm_cmpeq_epi16(diff, _mm_setzero_si128()), _mm_set1_epi16(1));
+        __m128i relaxed = _mm_add_epi16(_mm_add_epi16(t, _mm_mulhi_epu16(diff, r)), atLeastOne);
+        // unsigned min(relaxed, d), which picks d when it is closer
+        t = _mm_sub_epi16(relaxed, _mm_subs_epu16(relaxed, d));
+        _mm_storeu_si128((__m128i*)(trail+i), t);
+        _mm_storeu_si128((__m128i*)(out+i), _mm_srli_epi16(t, 5));
+    }
+#endif
+    for(; i<n; i++){
+        unsigned int d = depth[i] << 5;
+        unsigned int t = trail[i];
+        if(d < t){
+            t = d;
+        }else if(d > t){
+            t = MIN(d, t + (((d-t)*rate) >> 16) + 1);
+        }
+        trail[i] = (uint16_t)t;
+        out[i] = (uint16_t)(t >> 5);
+    }
+}
+
+// users of DepthProcessor::takeStats
+#define statsConsole 0
+#define statsHud 1
+#define statsReaders 2
+
+// Turns 640x480 11-bit depth frames into the colorized 320x240 output.
+// Frames can come from the Kinect (MyFreenectDevice) or from the
+// synthetic scene generator (SyntheticDepthSource).
+class DepthProcessor {
     public:
         uint16_t* bufferPt[maxBuffers];
         uint8_t gradient[2048*3];
@@ -357,11 +1367,19 @@ class MyFreenectDevice : public Freenect::FreenectDevice {
         uint16_t* tempBufferB;
         uint16_t* tempPointer;
         uint16_t* procDepth;
+        uint16_t* trailDepth;
+        uint8_t* contourMask;
+        BlobTracker blobTracker;
 
-        MyFreenectDevice(freenect_context *_ctx, int _index) : Freenect::FreenectDevice(_ctx, _index),
+        DepthProcessor() :
         m_buffer_depth(bufferWidth*bufferHeight*3), 
         m_gamma(2048), 
-        m_new_depth_frame(false) {
+        m_new_depth_frame(false),
+        m_remap(bufferWidth*bufferHeight),
+        m_remap_pad(-1),
+        m_remap_keystone(0),
+        m_remap_mirror(false),
+        m_remap_flip(false) {
             srand((unsigned)time(0));
             for(unsigned int i=0; i<maxBuffers; i++){
                 bufferPt[i] = (uint16_t*) malloc(bufferWidth*bufferHeight*sizeof(uint16_t));
@@ -385,26 +1403,40 @@ class MyFreenectDevice : public Freenect::FreenectDevice {
 
             gradientOffset = 0;
             gradientOffsetB = 0;
+
+            contourInterval = 40;
+            contourSlope = 1;
+            contourMin = 0;
+            contourMax = 2046;
+            contourOffset = 0;
+            contourOffsetMin = 0;
+            contourOffsetMax = contourInterval-1;
             
             tempBufferA = (uint16_t*) malloc(bufferWidth*bufferHeight*sizeof(uint16_t));
             tempBufferB = (uint16_t*) malloc(bufferWidth*bufferHeight*sizeof(uint16_t));
             tempPointer = NULL;
             procDepth = (uint16_t*) malloc(bufferWidth*bufferHeight*sizeof(uint16_t));
+            trailDepth = (uint16_t*) malloc(bufferWidth*bufferHeight*sizeof(uint16_t));
+            contourMask = (uint8_t*) calloc(bufferWidth*bufferHeight, sizeof(uint8_t));
+            clearTrail();
+
+            for(int r = 0; r < statsReaders; r++){
+                m_stat_frames[r] = 0;
+                m_stat_total_ms[r] = 0;
+                m_stat_max_ms[r] = 0;
+            }
 
             for( unsigned int i = 0 ; i < 2048 ; i++) {
                 float v = i/2048.0;
                 v = pow(v, 3)* 6;
-                m_gamma[i] = v*6*256;
+                m_gamma[i] = MIN(2047, v*6*256);
             }
         }
 
-        void VideoCallback(void* _rgb, uint32_t timestamp) {
-            ;            
-        };
-
-        void DepthCallback(void* _depth, uint32_t timestamp) {
+        // depth is 640x480 uint16_t, or the 11-bit packed stream if packed
+        void processDepth(void* _depth, uint32_t timestamp, bool packed) {
             m_depth_mutex.lock();
-            uint16_t* depth = static_cast<uint16_t*>(_depth);
+            double startTime = nowSeconds();
             
             // rotate buffers:
             tempPointer = bufferPt[maxBuffers-1];
@@ -415,11 +1447,16 @@ class MyFreenectDevice : public Freenect::FreenectDevice {
             bufferPt[0]=tempPointer;
 
             //downsample depth map into buffer
-            unsigned int index;
-            for(unsigned int x = 0; x<320; x++){
-                for(unsigned int y=0; y<240; y++){
-                    index = y*320+x;
-                    bufferPt[0][index] = MIN(MIN(MIN(depth[y*2*640+x*2],depth[y*2*640+x*2+1]),depth[(y*2+1)*640+x*2+1]),depth[(y*2+1)*640+x*2]);                
+            if(packed){
+                downsamplePacked11(static_cast<uint8_t*>(_depth), bufferPt[0]);
+            }else{
+                uint16_t* depth = static_cast<uint16_t*>(_depth);
+                unsigned int index;
+                for(unsigned int x = 0; x<320; x++){
+                    for(unsigned int y=0; y<240; y++){
+                        index = y*320+x;
+                        bufferPt[0][index] = MIN(MIN(MIN(depth[y*2*640+x*2],depth[y*2*640+x*2+1]),depth[(y*2+1)*640+x*2+1]),depth[(y*2+1)*640+x*2]);                
+                    }
                 }
             }
 
@@ -441,25 +1478,39 @@ class MyFreenectDevice : public Freenect::FreenectDevice {
                 }              
             }              
                 
-            uint16_t tempDepth;
-            for(unsigned int i = 0; i<bufferWidth*bufferHeight; i++){
-                tempDepth = (uint16_t)2047;
-                for(unsigned int j=0; j<currentBuffers; j+=6){
-                    tempDepth = MIN(bufferPt[j][i],tempDepth);
-                }
-                procDepth[i] = tempDepth;
-            }  
+            if(decayTrailSet){
+                // fraction of the way back to the current depth per frame
+                double rate = (1-exp(-1/trailLength))*65536;
+                decayTrail(bufferPt[0], trailDepth, procDepth, bufferWidth*bufferHeight, (uint16_t)MIN(65535, rate));
+            }else{
+                uint16_t tempDepth;
+                for(unsigned int i = 0; i<bufferWidth*bufferHeight; i++){
+                    tempDepth = (uint16_t)2047;
+                    for(unsigned int j=0; j<currentBuffers; j+=6){
+                        tempDepth = MIN(bufferPt[j][i],tempDepth);
+                    }
+                    procDepth[i] = tempDepth;
+                }  
+            }
 
             // median filter
             if(medianFilterSet){ medianFilter(procDepth,bufferHeight,bufferWidth); }  
 
+            // per-dancer regions
+            int blobs = blobMode;
+            if(blobs != blobOff){ blobTracker.update(procDepth); }
+
             // move color gradients (should add option to adjust speed)
             if(gradientMotionSet){
                 gradientOffset += 5;//13;
                 if(gradientOffset>2047){ gradientOffset = 0; }
                 gradientOffsetB -= 3;//7;
                 if(gradientOffsetB<0){ gradientOffsetB = 2047; }
+                // contour lines drift along with the gradients
+                contourOffset += contourSlope;
             }
+            contourOffsetMax = contourInterval-1;
+            if(contourOffset>contourOffsetMax || contourOffset<contourOffsetMin){ contourOffset = contourOffsetMin; }
 
             // create combined gradient using both gradients at current offsets
             for(int i=0; i<2048; i++){
@@ -478,17 +1529,115 @@ class MyFreenectDevice : public Freenect::FreenectDevice {
                 gradientMod[i] = (uint8_t)(gradientMod[i]/brightnessFactor);
             }
 
-            // convert depth map values to gradient colors
-            for( unsigned int x=2 ; x<bufferWidth-5; x++){
+            // camera frame taken closest to this depth frame, if any
+            const uint8_t* video = NULL;
+            int blend = videoBlend;
+            if(videoConverter && blend > 0){ video = videoConverter->acquireNearest(timestamp); }
+
+            // contour lines, flagged in depth-map space
+            int contours = contourMode;
+            uint8_t lineLevel = (uint8_t)(255/brightnessFactor);
+            if(contours != contourOff){
                 for( unsigned int y=1; y<bufferHeight-1; y++) {
-                    unsigned int i = y*bufferWidth + x;
-                    unsigned int pval = (unsigned int)m_gamma[procDepth[i]];
-                    m_buffer_depth[3*i+0] = gradientMod[3*pval+0];
-                    m_buffer_depth[3*i+1] = gradientMod[3*pval+1];
-                    m_buffer_depth[3*i+2] = gradientMod[3*pval+2];
+                    for( unsigned int x=2 ; x<bufferWidth-5; x+=8){
+                        // last chunk overlaps the previous one to end on the border
+                        unsigned int row = y*bufferWidth + MIN(x, bufferWidth-5-8);
+                        contourEdges(&procDepth[row], bufferWidth, contourOffset, contourInterval, contourMin, contourMax, &contourMask[row]);
+                    }
                 }
             }
+
+            // rebuild the remap table if the geometry changed
+            if(windowPad != m_remap_pad || keystone != m_remap_keystone ||
+               mirrorSet != m_remap_mirror || flipSet != m_remap_flip){
+                m_remap_pad = windowPad;
+                m_remap_keystone = keystone;
+                m_remap_mirror = mirrorSet;
+                m_remap_flip = flipSet;
+                buildRemap(&m_remap[0], bufferWidth, bufferHeight);
+            }
+
+            // convert depth map values to gradient colors, gathering each
+            // output pixel from the depth map through the remap table
+            for( unsigned int o=0; o<bufferWidth*bufferHeight; o++){
+                int i = m_remap[o];
+                if(i < 0){
+                    m_buffer_depth[3*o+0] = 0;
+                    m_buffer_depth[3*o+1] = 0;
+                    m_buffer_depth[3*o+2] = 0;
+                    continue;
+                }
+                unsigned int pval = (unsigned int)m_gamma[procDepth[i]];
+                uint8_t r = gradientMod[3*pval+0];
+                uint8_t g = gradientMod[3*pval+1];
+                uint8_t b = gradientMod[3*pval+2];
+                bool line = contours != contourOff && contourMask[i];
+                if(contours == contourOnly && !line){
+                    r = g = b = 0;
+                }
+                if(blobs != blobOff && blobTracker.labels[i]){
+                    // dancer's own hue at the gradient's brightness
+                    const uint8_t* c = blobTracker.blobs[blobTracker.labels[i]-1].color;
+                    unsigned int lum = MAX(r, MAX(g, b));
+                    r = (uint8_t)((c[0]*lum) >> 8);
+                    g = (uint8_t)((c[1]*lum) >> 8);
+                    b = (uint8_t)((c[2]*lum) >> 8);
+                }
+                if(video){
+                    // mix in the camera color
+                    r = (uint8_t)((r*(256-blend) + video[4*i+0]*blend) >> 8);
+                    g = (uint8_t)((g*(256-blend) + video[4*i+1]*blend) >> 8);
+                    b = (uint8_t)((b*(256-blend) + video[4*i+2]*blend) >> 8);
+                }
+                if(contours == contourOverlay && line){
+                    r = g = b = lineLevel;
+                }
+                m_buffer_depth[3*o+0] = r;
+                m_buffer_depth[3*o+1] = g;
+                m_buffer_depth[3*o+2] = b;
+            }
+            if(video){ videoConverter->release(); }
             m_new_depth_frame = true;
+
+            // analytics get this frame's depth; procDepth is rewritten in
+            // full every frame, so a retired buffer can take its place
+            if(heatmap && heatmapSet){ procDepth = heatmap->offer(procDepth); }
+
+            double frameMs = (nowSeconds()-startTime)*1000;
+            for(int r = 0; r < statsReaders; r++){
+                m_stat_frames[r]++;
+                m_stat_total_ms[r] += frameMs;
+                m_stat_max_ms[r] = MAX(m_stat_max_ms[r], frameMs);
+            }
+            m_depth_mutex.unlock();
+        }
+
+        // processing time in ms per frame since this reader's last call;
+        // each reader (statsConsole, statsHud) has its own counters so
+        // they don't steal frames from each other
+        unsigned int takeStats(int reader, double &avgMs, double &maxMs) {
+            m_depth_mutex.lock();
+            unsigned int frames = m_stat_frames[reader];
+            avgMs = frames ? m_stat_total_ms[reader]/frames : 0;
+            maxMs = m_stat_max_ms[reader];
+            m_stat_frames[reader] = 0;
+            m_stat_total_ms[reader] = 0;
+            m_stat_max_ms[reader] = 0;
+            m_depth_mutex.unlock();
+            return frames;
+        }
+
+        // forget the decay trail, e.g. when it is switched back on
+        void resetTrail() {
+            m_depth_mutex.lock();
+            clearTrail();
+            m_depth_mutex.unlock();
+        }
+
+        // blobs as of the last processed frame
+        void getBlobs(vector<Blob> &out) {
+            m_depth_mutex.lock();
+            out = blobTracker.blobs;
             m_depth_mutex.unlock();
         }
 
@@ -506,18 +1655,214 @@ class MyFreenectDevice : public Freenect::FreenectDevice {
         }
         
     private:
+        void clearTrail() {
+            for(unsigned int i = 0; i<bufferWidth*bufferHeight; i++){
+                trailDepth[i] = 2047 << 5;
+            }
+        }
+
         vector<uint8_t> m_buffer_depth;
         vector<uint16_t> m_gamma;
         Mutex m_depth_mutex;
         bool m_new_depth_frame;
+        unsigned int m_stat_frames[statsReaders];
+        double m_stat_total_ms[statsReaders];
+        double m_stat_max_ms[statsReaders];
+        vector<int> m_remap;
+        int m_remap_pad;
+        float m_remap_keystone;
+        bool m_remap_mirror;
+        bool m_remap_flip;
+};
+
+DepthProcessor* processor;
+
+class MyFreenectDevice : public Freenect::FreenectDevice {
+    public:
+        MyFreenectDevice(freenect_context *_ctx, int _index) : Freenect::FreenectDevice(_ctx, _index) {}
+
+        void VideoCallback(void* _rgb, uint32_t timestamp) {
+            if(videoConverter){ videoConverter->pushRaw(_rgb, timestamp); }
+        };
+
+        void DepthCallback(void* _depth, uint32_t timestamp) {
+            processor->processDepth(_depth, timestamp, packedDepthSet);
+        }
 };
 
 //define libfreenect variables
-Freenect::Freenect freenect;
-MyFreenectDevice* device;
+// only created on the Kinect path, so --synthetic works without USB access
+Freenect::Freenect* freenect = NULL;
+MyFreenectDevice* device = NULL;
 double freenect_angle(0);
 freenect_video_format requested_format(FREENECT_VIDEO_RGB);
 
+// Procedural stand-in for the Kinect: moving blobs in front of a wall and
+// floor, with 2047 holes, shadow bands and sensor noise. Frames are pushed
+// through DepthProcessor::processDepth at syntheticRate, so the processing
+// pipeline can be stressed and timed without hardware.
+struct SyntheticBlob {
+    float x, y, z;      // center in 640x480 pixels, raw depth
+    float vx, vy, vz;   // per-frame motion
+};
+
+class SyntheticDepthSource {
+    public:
+        SyntheticDepthSource(DepthProcessor* target) :
+        m_target(target),
+        m_frame(640*480),
+        m_packed(packedRowBytes*480),
+        m_seed(0x2545F491) {
+            for(int i=0; i<syntheticBlobs; i++){
+                SyntheticBlob b;
+                b.x = randomRange(0, 640);
+                b.y = randomRange(120, 360);
+                b.z = randomRange(550, 950);
+                b.vx = randomRange(-6, 6);
+                b.vy = randomRange(-2, 2);
+                b.vz = randomRange(-4, 4);
+                m_blobs.push_back(b);
+            }
+        }
+
+        void start() {
+            pthread_create(&m_thread, NULL, &SyntheticDepthSource::threadMain, this);
+        }
+
+        // render the next frame of the scene into a 640x480 buffer
+        void makeFrame(uint16_t* frame) {
+            // back wall, with the floor coming closer toward the bottom
+            for(int y=0; y<480; y++){
+                uint16_t rowDepth = (uint16_t)(y < 240 ? 1000 : 1000 - (y-240)*0.9f);
+                for(int x=0; x<640; x++){
+                    frame[y*640+x] = rowDepth;
+                }
+            }
+
+            for(unsigned int i=0; i<m_blobs.size(); i++){
+                SyntheticBlob &b = m_blobs[i];
+                moveBlob(b);
+                drawBlob(frame, b);
+            }
+
+            // sensor noise
+            int span = 2*syntheticNoise+1;
+            if(syntheticNoise > 0){
+                for(int i=0; i<640*480; i++){
+                    if(frame[i] != 2047){
+                        frame[i] = (uint16_t)MIN(2046, MAX(0, int(frame[i]) + int(nextRandom() % span) - syntheticNoise));
+                    }
+                }
+            }
+
+            // dropouts, as short horizontal runs
+            int holes = int(syntheticHoleFraction*640*480/4);
+            for(int i=0; i<holes; i++){
+                unsigned int start = nextRandom() % (640*480);
+                unsigned int len = 1 + nextRandom() % 7;
+                for(unsigned int j=start; j<start+len && j<640*480; j++){
+                    frame[j] = 2047;
+                }
+            }
+        }
+
+    private:
+        static void* threadMain(void* arg) {
+            static_cast<SyntheticDepthSource*>(arg)->run();
+            return NULL;
+        }
+
+        void run() {
+            uint32_t timestamp = 0;
+            double nextFrame = nowSeconds();
+            double nextReport = nextFrame + 1;
+            while(true){
+                makeFrame(&m_frame[0]);
+                if(packedDepthSet){
+                    // exercise the packed ingest path like a real Kinect would
+                    packDepth11(&m_frame[0], &m_packed[0], 640*480);
+                    m_target->processDepth(&m_packed[0], timestamp, true);
+                }else{
+                    m_target->processDepth(&m_frame[0], timestamp, false);
+                }
+                timestamp++;
+
+                double now = nowSeconds();
+                if(now >= nextReport){
+                    double avgMs, maxMs;
+                    unsigned int frames = m_target->takeStats(statsConsole, avgMs, maxMs);
+                    printf("\r\n synthetic: %.1f fps, processing %.2f ms/frame avg, %.2f max (sustainable ~%.0f fps)",
+                           frames/(now-nextReport+1), avgMs, maxMs, avgMs > 0 ? 1000/avgMs : 0);
+                    fflush(stdout);
+                    nextReport = now + 1;
+                }
+
+                if(syntheticRate > 0){
+                    nextFrame += 1/syntheticRate;
+                    if(nextFrame > now){
+                        usleep((useconds_t)((nextFrame-now)*1e6));
+                    }else{
+                        // fell behind, don't try to catch up
+                        nextFrame = now;
+                    }
+                }
+            }
+        }
+
+        void moveBlob(SyntheticBlob &b) {
+            b.x += b.vx; b.y += b.vy; b.z += b.vz;
+            if(b.x < 0 || b.x > 640){ b.vx = -b.vx; }
+            if(b.y < 120 || b.y > 360){ b.vy = -b.vy; }
+            if(b.z < 550 || b.z > 950){ b.vz = -b.vz; }
+        }
+
+        // upright ellipsoid (roughly a dancer), bulging toward the camera,
+        // with a shadow band along its left edge
+        void drawBlob(uint16_t* frame, const SyntheticBlob &b) {
+            // nearer blobs look bigger
+            float rx = syntheticBlobSize*800/b.z;
+            float ry = rx*2.5f;
+            int shadow = int(rx*2*syntheticShadowFraction);
+            int y0 = MAX(0, int(b.y-ry)), y1 = MIN(479, int(b.y+ry));
+            for(int y=y0; y<=y1; y++){
+                float dy = (y-b.y)/ry;
+                float halfWidth = 1-dy*dy;
+                if(halfWidth <= 0){ continue; }
+                halfWidth = rx*sqrtf(halfWidth);
+                int x0 = MAX(0, int(b.x-halfWidth)), x1 = MIN(639, int(b.x+halfWidth));
+                for(int x=MAX(0, x0-shadow); x<x0; x++){
+                    if(frame[y*640+x] > b.z){ frame[y*640+x] = 2047; }
+                }
+                for(int x=x0; x<=x1; x++){
+                    float dx = (x-b.x)/rx;
+                    uint16_t d = (uint16_t)(b.z + (dx*dx+dy*dy)*30);
+                    if(d < frame[y*640+x] || frame[y*640+x] == 2047){ frame[y*640+x] = d; }
+                }
+            }
+        }
+
+        // xorshift, so the noise doesn't contend on rand()
+        uint32_t nextRandom() {
+            m_seed ^= m_seed << 13;
+            m_seed ^= m_seed >> 17;
+            m_seed ^= m_seed << 5;
+            return m_seed;
+        }
+
+        float randomRange(float lo, float hi) {
+            return lo + (hi-lo)*(nextRandom() % 10000)/10000.0f;
+        }
+
+        DepthProcessor* m_target;
+        vector<SyntheticBlob> m_blobs;
+        vector<uint16_t> m_frame;
+        vector<uint8_t> m_packed;
+        uint32_t m_seed;
+        pthread_t m_thread;
+};
+
+SyntheticDepthSource* synthetic = NULL;
+
 //define Kinect Device control elements
 //glutKeyboardFunc Handler
 void keyPressed(unsigned char key, int x, int y)
@@ -527,7 +1872,10 @@ void keyPressed(unsigned char key, int x, int y)
     case (char)27:
     case 'q':
     case 'Q':
-        device->setLed(LED_RED);
+        if(device){ device->setLed(LED_RED); }
+        // glutMainLoop exits the process, so save what the last periodic
+        // snapshot missed now
+        if(heatmap && heatmapExportSet){ heatmap->exportSnapshot(); }
         freenect_angle = 0;
         //glutReshapeWindow(640, 480);
         //fullscreen = false;
@@ -542,12 +1890,17 @@ void keyPressed(unsigned char key, int x, int y)
         outputString = "ESC,Q :   Quit\n"
                        "        H :   Display this message\n"
                        "        F :   Fullscreen ON/OFF\n"
-                       "     + - :   Adjust number of motion-trail buffers\n"
+                       "  + - E :   Adjust motion-trail length, buffers/decay\n"
                        "       [ ] :   Adjust screen brightness\n"
                        "     < > :   Adjust window width padding\n"
-                       "       M :   Median filter ON/OFF\n"
-                       "         I :   In-painting ON/OFF\n"
-                       "       G :   Color gradient movement ON/OFF\n"
+                       "      K L :   Adjust keystone (top/bottom width)\n"
+                       "      X Y :   Mirror left-right / flip upside down\n"
+                       "  M I G :   Median filter, in-painting, gradient movement ON/OFF\n"
+                       "        T :   Show frame processing time\n"
+                       "        V :   Cycle camera color blend (with --video)\n"
+                       " C 9 0 :   Contour lines OFF/OVER/ONLY, line spacing\n"
+                       "        O :   Floor occupancy heatmap overlay ON/OFF\n"
+                       "        B :   Dancer colors OFF/ON/WITH READOUTS\n"
                        "\n space :   Hide text\n"
                        ;
         lineSpacing = 25;
@@ -583,6 +1936,105 @@ void keyPressed(unsigned char key, int x, int y)
             setOutputString("Color gradient movement is OFF");
         }
         break;
+    case 'v':
+    case 'V':
+        if(!videoConverter){
+            setOutputString("Camera is off, start with --video");
+            break;
+        }
+        videoBlend += 64;
+        if (videoBlend > 192 ){ videoBlend = 0; }
+        sprintf(outputCharBuf,"Camera color blend is now %i%%", videoBlend*100/256);
+        setOutputString(outputCharBuf);
+        break;
+    case 'c':
+    case 'C':
+        contourMode = (contourMode+1) % 3;
+        if (contourMode == contourOverlay){
+            setOutputString("Contour lines are ON");
+        }else if (contourMode == contourOnly){
+            setOutputString("Contour lines ONLY");
+        }else{
+            setOutputString("Contour lines are OFF");
+        }
+        break;
+    case '9':
+    case '(':
+        processor->contourInterval -= 5;
+        if (processor->contourInterval < 10 ){ processor->contourInterval = 10; }
+        sprintf(outputCharBuf,"Contour line spacing is now %i", processor->contourInterval);
+        setOutputString(outputCharBuf);
+        break;
+    case '0':
+    case ')':
+        processor->contourInterval += 5;
+        if (processor->contourInterval > 400 ){ processor->contourInterval = 400; }
+        sprintf(outputCharBuf,"Contour line spacing is now %i", processor->contourInterval);
+        setOutputString(outputCharBuf);
+        break;
+    case 'o':
+    case 'O':
+        heatmapOverlaySet = !heatmapOverlaySet;
+        // the overlay needs the heatmap running, but only --heatmap saves it
+        heatmapSet = heatmapSet || heatmapOverlaySet;
+        if (heatmapOverlaySet){
+            setOutputString("Heatmap overlay is ON");
+        }else{
+            setOutputString("Heatmap overlay is OFF");
+        }
+        break;
+    case 'b':
+    case 'B':
+        blobMode = (blobMode+1) % 3;
+        if (blobMode == blobColors){
+            setOutputString("Dancer colors are ON");
+        }else if (blobMode == blobReadouts){
+            setOutputString("Dancer colors and readouts are ON");
+        }else{
+            setOutputString("Dancer colors are OFF");
+        }
+        break;
+    case 'k':
+    case 'K':
+        keystone -= 0.02;
+        if (keystone < -0.5 ){ keystone = -0.5; }
+        sprintf(outputCharBuf,"Keystone is now %.2f", keystone);
+        setOutputString(outputCharBuf);
+        break;
+    case 'l':
+    case 'L':
+        keystone += 0.02;
+        if (keystone > 0.5 ){ keystone = 0.5; }
+        sprintf(outputCharBuf,"Keystone is now %.2f", keystone);
+        setOutputString(outputCharBuf);
+        break;
+    case 'x':
+    case 'X':
+        mirrorSet = !mirrorSet;
+        if (mirrorSet){
+            setOutputString("Mirror is ON");
+        }else{
+            setOutputString("Mirror is OFF");
+        }
+        break;
+    case 'y':
+    case 'Y':
+        flipSet = !flipSet;
+        if (flipSet){
+            setOutputString("Upside-down flip is ON");
+        }else{
+            setOutputString("Upside-down flip is OFF");
+        }
+        break;
+    case 't':
+    case 'T':
+        {
+            double avgMs, maxMs;
+            unsigned int frames = processor->takeStats(statsHud, avgMs, maxMs);
+            sprintf(outputCharBuf,"Processing %.2f ms/frame avg, %.2f max over %u frames", avgMs, maxMs, frames);
+            setOutputString(outputCharBuf);
+        }
+        break;
     case 'f':
     case 'F':
         if(fullscreen){
@@ -600,8 +2052,26 @@ void keyPressed(unsigned char key, int x, int y)
             setOutputString("Fullscreen ON");
         }
         break;
+    case 'e':
+    case 'E':
+        decayTrailSet = !decayTrailSet;
+        if (decayTrailSet){
+            // don't start from whatever the trail held last time
+            processor->resetTrail();
+            setOutputString("Motion trail uses decay");
+        }else{
+            setOutputString("Motion trail uses buffers");
+        }
+        break;
     case '-':
     case '_':
+        if (decayTrailSet){
+            trailLength /= 1.25;
+            if (trailLength < 0.1 ){ trailLength = 0.1; }
+            sprintf(outputCharBuf,"Trail length is now %.1f frames", trailLength);
+            setOutputString(outputCharBuf);
+            break;
+        }
         currentBuffers--;
         if (currentBuffers < 2 ){ currentBuffers = 2; }
         sprintf(outputCharBuf,"Number of buffers is now %i", currentBuffers);
@@ -609,6 +2079,13 @@ void keyPressed(unsigned char key, int x, int y)
         break;
     case '=':
     case '+':
+        if (decayTrailSet){
+            trailLength *= 1.25;
+            if (trailLength > 1000 ){ trailLength = 1000; }
+            sprintf(outputCharBuf,"Trail length is now %.1f frames", trailLength);
+            setOutputString(outputCharBuf);
+            break;
+        }
         currentBuffers++;
         if (currentBuffers > maxBuffers ){ currentBuffers = maxBuffers; }
         sprintf(outputCharBuf,"Number of buffers is now %i", currentBuffers);
@@ -638,7 +2115,8 @@ void keyPressed(unsigned char key, int x, int y)
     case ',':
     case '>':
         windowPad += 10;
-        if (windowPad > windowWidth/2 ){ windowPad = windowWidth/2; }
+        // padding is applied in the 640-wide texture space (see remapWidth)
+        if (windowPad > 310 ){ windowPad = 310; }
         sprintf(outputCharBuf,"Window width padding is now %i", windowPad);
         setOutputString(outputCharBuf);
         break;
@@ -669,13 +2147,63 @@ void renderBitmapString(
     }
 }
 
+// translucent cells over the picture: red for occupancy, green for
+// activity, each scaled to its busiest cell
+void drawHeatmapOverlay()
+{
+    static vector<float> occupancy, activity;
+    heatmap->snapshot(occupancy, activity);
+    float maxOccupancy = 1e-6, maxActivity = 1e-6;
+    for(unsigned int c=0; c<occupancy.size(); c++){
+        maxOccupancy = MAX(maxOccupancy, occupancy[c]);
+        maxActivity = MAX(maxActivity, activity[c]);
+    }
+
+    glDisable(GL_TEXTURE_2D);
+    glBegin(GL_QUADS);
+    for(unsigned int cy=0; cy<heatmap->rows; cy++){
+        for(unsigned int cx=0; cx<heatmap->cols; cx++){
+            float occ = occupancy[cy*heatmap->cols+cx]/maxOccupancy;
+            float act = activity[cy*heatmap->cols+cx]/maxActivity;
+            glColor4f(occ, act, 0.0f, 0.6f*MAX(occ, act));
+            // cell corners through the output geometry
+            float x, y;
+            sourceToScreen(cx*heatCell, cy*heatCell, x, y);         glVertex3f(x, y, -1);
+            sourceToScreen((cx+1)*heatCell, cy*heatCell, x, y);     glVertex3f(x, y, -1);
+            sourceToScreen((cx+1)*heatCell, (cy+1)*heatCell, x, y); glVertex3f(x, y, -1);
+            sourceToScreen(cx*heatCell, (cy+1)*heatCell, x, y);     glVertex3f(x, y, -1);
+        }
+    }
+    glEnd();
+}
+
+// id, size and speed next to each dancer
+void drawBlobReadouts()
+{
+    static vector<Blob> blobs;
+    static char label[64];
+    processor->getBlobs(blobs);
+    float scaleY = glutGet(GLUT_WINDOW_HEIGHT)/480.0f;
+    glDisable(GL_TEXTURE_2D);
+    for(unsigned int i=0; i<blobs.size(); i++){
+        Blob &b = blobs[i];
+        sprintf(label, "#%i  %u px  %.0f px/s", b.id, b.area, sqrtf(b.vx*b.vx+b.vy*b.vy));
+        glColor3ub(b.color[0], b.color[1], b.color[2]);
+        // above whichever end of the blob is on top after the remap
+        float x, top, bottom;
+        sourceToScreen(b.cx, b.y0, x, top);
+        sourceToScreen(b.cx, b.y1, x, bottom);
+        renderBitmapString(x, MAX(15, MIN(top, bottom)*scaleY), -0.5f, monoFont, label);
+    }
+}
+
 void DrawGLScene()
 {
     static std::vector<uint8_t> depth(bufferWidth*bufferHeight*4);
 
-    device->updateState();
+    if(device){ device->updateState(); }
 
-    device->getDepth(depth);
+    processor->getDepth(depth);
 
     got_frames = 0;
 
@@ -689,12 +2217,16 @@ void DrawGLScene()
 
     glBegin(GL_TRIANGLE_FAN);
     glColor4f(255.0f, 255.0f, 255.0f, 255.0f);
-    glTexCoord2f(0, 0); glVertex3f(windowPad,0,-1);
-    glTexCoord2f(1, 0); glVertex3f(640-windowPad,0,-1);
-    glTexCoord2f(1, 1); glVertex3f(640-windowPad,480,-1);
-    glTexCoord2f(0, 1); glVertex3f(windowPad,480,-1);
+    // padding and other geometry are already in the texture (see buildRemap)
+    glTexCoord2f(0, 0); glVertex3f(0,0,-1);
+    glTexCoord2f(1, 0); glVertex3f(640,0,-1);
+    glTexCoord2f(1, 1); glVertex3f(640,480,-1);
+    glTexCoord2f(0, 1); glVertex3f(0,480,-1);
     glEnd();
 
+    if(heatmapOverlaySet){ drawHeatmapOverlay(); }
+    if(blobMode == blobReadouts){ drawBlobReadouts(); }
+
     // countdown user notification timer, blank if 0
     hackyTimer--;
     if (hackyTimer < 0){ hackyTimer = 0; outputString = ""; lineSpacing=25;}    
@@ -756,24 +2288,110 @@ void displayKinectData(MyFreenectDevice* device){
 }
 
 
+void printUsage(char* prog){
+    printf("usage: %s [options]\n"
+           "  --synthetic          use generated depth frames instead of a Kinect\n"
+           "  --rate FPS           synthetic frame rate, 0 = as fast as possible (%.0f)\n"
+           "  --blobs N            number of synthetic blobs (%i)\n"
+           "  --blob-size PX       synthetic blob radius (%.0f)\n"
+           "  --holes F            fraction of pixels dropped to 2047 (%.2f)\n"
+           "  --shadows F          shadow band width relative to blob width (%.2f)\n"
+           "  --noise N            synthetic depth noise, +/- raw units (%i)\n"
+           "  --video              blend the RGB camera into the output\n"
+           "  --bayer              take raw Bayer frames from the camera instead of RGB\n"
+           "  --packed             take depth as packed 11-bit and unpack it while downsampling\n"
+           "  --selftest           check the packed depth kernel against its reference and exit\n"
+           "  --keystone F         narrow the top (F > 0) or bottom (F < 0) edge by F\n"
+           "  --mirror             flip the picture left-right\n"
+           "  --flip               flip the picture upside down (ceiling mount)\n"
+           "  --heatmap FILE       record floor occupancy, saved to FILE as CSV\n"
+           "  --heatmap-interval S seconds between heatmap saves (%.0f)\n",
+           prog, syntheticRate, syntheticBlobs, syntheticBlobSize,
+           syntheticHoleFraction, syntheticShadowFraction, syntheticNoise,
+           heatmapExportSeconds);
+}
+
 //define main function
 int main(int argc, char **argv) {
-    device = &freenect.createDevice<MyFreenectDevice>(0);
-    // do this a few times - for some reason fails on the first try sometimes
-    device = &freenect.createDevice<MyFreenectDevice>(0);
-    device = &freenect.createDevice<MyFreenectDevice>(0);
+    for(int i=1; i<argc; i++){
+        bool hasValue = i+1 < argc;
+        if(!strcmp(argv[i], "--synthetic")){
+            syntheticSet = true;
+        }else if(!strcmp(argv[i], "--rate") && hasValue){
+            syntheticRate = MAX(0, atof(argv[++i]));
+        }else if(!strcmp(argv[i], "--blobs") && hasValue){
+            syntheticBlobs = MAX(0, atoi(argv[++i]));
+        }else if(!strcmp(argv[i], "--blob-size") && hasValue){
+            syntheticBlobSize = MAX(1, atof(argv[++i]));
+        }else if(!strcmp(argv[i], "--holes") && hasValue){
+            syntheticHoleFraction = MIN(1, MAX(0, atof(argv[++i])));
+        }else if(!strcmp(argv[i], "--shadows") && hasValue){
+            syntheticShadowFraction = MAX(0, atof(argv[++i]));
+        }else if(!strcmp(argv[i], "--noise") && hasValue){
+            syntheticNoise = MAX(0, atoi(argv[++i]));
+        }else if(!strcmp(argv[i], "--video")){
+            videoSet = true;
+        }else if(!strcmp(argv[i], "--bayer")){
+            requested_format = FREENECT_VIDEO_BAYER;
+        }else if(!strcmp(argv[i], "--packed")){
+            packedDepthSet = true;
+        }else if(!strcmp(argv[i], "--selftest")){
+            return selfTestPacked() ? 0 : 1;
+        }else if(!strcmp(argv[i], "--keystone") && hasValue){
+            keystone = MIN(0.5, MAX(-0.5, atof(argv[++i])));
+        }else if(!strcmp(argv[i], "--mirror")){
+            mirrorSet = true;
+        }else if(!strcmp(argv[i], "--flip")){
+            flipSet = true;
+        }else if(!strcmp(argv[i], "--heatmap") && hasValue){
+            heatmapSet = true;
+            heatmapExportSet = true;
+            heatmapPath = argv[++i];
+        }else if(!strcmp(argv[i], "--heatmap-interval") && hasValue){
+            heatmapExportSeconds = MAX(1, atof(argv[++i]));
+        }else{
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
 
-    // Start Kinect Device
-    device->setTiltDegrees(0);
-    device->startDepth();
-    device->setLed(LED_GREEN);
+    processor = new DepthProcessor();
+    heatmap = new FloorHeatmap();
+    heatmap->start();
+
+    if(syntheticSet){
+        if(videoSet){ printf("\r\n --video needs a Kinect, ignoring it\n"); }
+        synthetic = new SyntheticDepthSource(processor);
+        synthetic->start();
+    }else{
+        freenect = new Freenect::Freenect();
+        device = &freenect->createDevice<MyFreenectDevice>(0);
+        // do this a few times - for some reason fails on the first try sometimes
+        device = &freenect->createDevice<MyFreenectDevice>(0);
+        device = &freenect->createDevice<MyFreenectDevice>(0);
+
+        // Start Kinect Device
+        device->setTiltDegrees(0);
+        if(packedDepthSet){ device->setDepthFormat(FREENECT_DEPTH_11BIT_PACKED); }
+        device->startDepth();
+        if(videoSet){
+            videoConverter = new VideoConverter(requested_format);
+            videoConverter->start();
+            device->setVideoFormat(requested_format);
+            device->startVideo();
+        }
+        device->setLed(LED_GREEN);
+    }
 
     // start GL window
     displayKinectData(device);
 
     // Stop Kinect Device
-    device->setLed(LED_RED);
-    device->stopDepth();
+    if(device){
+        device->setLed(LED_RED);
+        device->stopDepth();
+        if(videoSet){ device->stopVideo(); }
+    }
 
     glutDestroyWindow(window);
 